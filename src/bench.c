@@ -0,0 +1,569 @@
+//
+// bench.c: micro-benchmarks for the hot paths of the webserver.
+//
+// To run, try:
+//      make bench      (or ./wbench [-o csvfile] [-n scale])
+//
+// Drives the request buffer (FIFO, SFF and DRR), the dequeue path of the
+// server threads (duplicate grouping and Flights), request_parse_uri(),
+// request_get_filetype(), readline() and the response header formatting
+// directly with synthetic workloads, without any network traffic.
+// Prints ns/op for every case, and writes the same rows as CSV to 'csvfile'.
+// Workloads use fixed seeds and the cases always run in the same order,
+// so CSV files of different runs can be compared line by line.
+//
+
+#include "request.c"	// the buffer and the parser are private to request.c
+#include <math.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/ec.h>
+
+#define QUEUE_ITERS 200000
+#define THREAD_ITERS 200000
+#define PARSE_ITERS 1000000
+#define READLINE_BYTES (1 << 20)	// readline() costs a syscall per byte
+
+FILE *csv = NULL;
+long scale = 1;
+
+long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Prints one result, 'params' describes the workload (key=value;...)
+void report(char *bench, char *params, long iters, long elapsed) {
+	double ns_per_op = (double) elapsed / iters;
+	printf("%-16s %-40s %10ld %12.1f ns/op\n", bench, params, iters, ns_per_op);
+	if (csv)
+		fprintf(csv, "%s,%s,%ld,%.1f\n", bench, params, iters, ns_per_op);
+}
+
+// Synthetic file sizes
+// ----------------------------------------------------------------
+enum { SIZES_CONST, SIZES_UNIFORM, SIZES_PARETO };
+char *size_names[] = { "const", "uniform", "pareto" };
+
+int next_size(int dist, unsigned int *seed) {
+	if (dist == SIZES_CONST)
+		return 4096;
+	if (dist == SIZES_UNIFORM)		// 1 byte to 64 KB
+		return 1 + rand_r(seed) % 65536;
+
+	// Pareto (alpha 1.2, from 1 KB): mostly small files and a few huge ones
+	double u = (rand_r(seed) + 1.0) / ((double) RAND_MAX + 2.0);
+	double size = 1024.0 / pow(u, 1 / 1.2);
+	return size > 1e8 ? 100000000 : (int) size;
+}
+// ----------------------------------------------------------------
+
+// Request buffer
+// ----------------------------------------------------------------
+enum { ALGO_FIFO, ALGO_SFF, ALGO_DRR };
+char *algo_names[] = { "fifo", "sff", "drr" };
+
+#define DRR_CLIENTS 16
+
+void bench_insert(Buffer *buf, int algo, int filesize, int fd) {
+	struct stat sbuf = { .st_size = filesize };	// only the size matters here
+	if (algo == ALGO_DRR)
+		insertDRR(buf, "./test1.html", &sbuf, fd, fd % DRR_CLIENTS);
+	else if (algo == ALGO_SFF)
+		insertSFF(buf, "./test1.html", &sbuf, fd);
+	else
+		insertFIFO(buf, "./test1.html", &sbuf, fd);
+}
+
+void bench_delete(Buffer *buf, int algo) {
+	Request *r;
+	if (algo == ALGO_DRR) {
+		r = deleteDRR(buf);
+		finishDRR(buf, r);
+	}
+	else if (algo == ALGO_SFF)
+		r = deleteSFF(buf);
+	else
+		r = deleteFIFO(buf);
+	free(r->filename);
+	free(r);
+}
+
+// Ages requests out of the buffer until only the 'keep' most recent are left
+// ('next_fd' is the fd the next inserted request will get)
+void bench_keep_newest(Buffer *buf, int algo, int keep, long next_fd) {
+	if (algo != ALGO_SFF) {
+		// FIFO hands them back oldest first, and DRR inserts do not depend on order
+		while (buf->count > keep)
+			bench_delete(buf, algo);
+		return;
+	}
+
+	long cutoff = next_fd - keep;
+	Request *prev = NULL, **ptr = &buf->front;
+	while (*ptr != NULL) {
+		Request *cur = *ptr;
+		if (cur->fd < cutoff) {
+			*ptr = cur->next;
+			buf->count--;
+			free(cur->filename);
+			free(cur);
+		} else {
+			prev = cur;
+			ptr = &cur->next;
+		}
+	}
+	buf->rear = prev;
+}
+
+//
+// Inserts into a buffer holding the 'depth' most recent requests (one op = one insert)
+// Requests are aged out in insertion order outside the timed part: taking the
+// smallest one out instead would leave SFF with only the largest sizes queued,
+// and every insert would land at the head whatever the depth
+//
+#define QUEUE_BATCH 16
+
+void bench_queue(int algo, int depth, int dist) {
+	Buffer b = {NULL, NULL, 0};
+	unsigned int seed = 1;
+	long iters = QUEUE_ITERS * scale / QUEUE_BATCH * QUEUE_BATCH;
+	long elapsed = 0, fd = 0;
+	char params[MAXBUF];
+
+	buffer_max_size = depth + QUEUE_BATCH;
+	while (fd < depth)
+		bench_insert(&b, algo, next_size(dist, &seed), fd++);
+
+	for (long i = 0; i < iters; i += QUEUE_BATCH) {
+		long start = now_ns();
+		for (int j = 0; j < QUEUE_BATCH; j++, fd++)
+			bench_insert(&b, algo, next_size(dist, &seed), fd);
+		elapsed += now_ns() - start;
+		bench_keep_newest(&b, algo, depth, fd);
+	}
+
+	while (b.count > 0)
+		bench_delete(&b, algo);
+
+	sprintf(params, "algo=%s;depth=%d;sizes=%s", algo_names[algo], depth, size_names[dist]);
+	report("queue_insert", params, iters, elapsed);
+}
+
+// Workload with duplicates: 'dups' percent of the requests are for one hot file
+int next_request(int dups, unsigned int *seed, long i, char *filename) {
+	if (rand_r(seed) % 100 < dups) {
+		strcpy(filename, "./hot.html");
+		return 4096;
+	}
+	sprintf(filename, "./file%ld.html", i);
+	return next_size(SIZES_UNIFORM, seed);
+}
+
+// Same as bench_insert(), into the server's own 'buffer' with the given filename
+void bench_enqueue(int algo, char *filename, int filesize, int fd) {
+	struct stat sbuf = { .st_size = filesize };	// same version of every file
+	if (algo == ALGO_DRR)
+		insertDRR(buffer, filename, &sbuf, fd, fd % DRR_CLIENTS);
+	else if (algo == ALGO_SFF)
+		insertSFF(buffer, filename, &sbuf, fd);
+	else
+		insertFIFO(buffer, filename, &sbuf, fd);
+}
+
+// What request_serve_static() does once the response is sent
+void bench_finish(Request *r, Flight *f) {
+	pthread_mutex_lock(&mutex);
+	if (r->client) {
+		finishDRR(buffer, r);
+		pthread_cond_signal(&fullBuff);
+	}
+	int last = releaseFlight(f);
+	pthread_mutex_unlock(&mutex);
+
+	// Nothing was mapped, the Flight only has to be freed
+	if (last) {
+		free(f->filename);
+		free(f);
+	}
+	free(r->filename);
+	free(r);
+}
+
+//
+// The dequeue sequence of a server thread, without the file and socket I/O:
+// request_dequeue() (scheduler, duplicate grouping and Flight lookup) and
+// the bookkeeping once the request is served (one op = one request)
+// Returns 0 once the buffer and the Flights are empty
+//
+int bench_dequeue_one() {
+	Flight *f;
+	int leader;
+
+	pthread_mutex_lock(&mutex);
+	Request *r = request_dequeue(&f, &leader);
+	pthread_cond_signal(&emptyBuff);
+	pthread_mutex_unlock(&mutex);
+	if (r == NULL)
+		return 0;
+
+	bench_finish(r, f);
+	return 1;
+}
+
+void bench_dequeue(int algo, int depth, int dups) {
+	Buffer b = {NULL, NULL, 0};
+	unsigned int seed = 1;
+	long iters = 0, elapsed = 0, fd = 0;
+	int batch = depth < QUEUE_BATCH ? depth : QUEUE_BATCH;
+	char filename[MAXBUF], params[MAXBUF];
+
+	buffer = &b;
+	scheduling_algo = algo;
+	buffer_max_size = depth;
+
+	while (iters < QUEUE_ITERS * scale) {
+		// Refill outside the timed part
+		while (b.count < depth) {
+			int filesize = next_request(dups, &seed, fd, filename);
+			bench_enqueue(algo, filename, filesize, fd++);
+		}
+
+		long start = now_ns();
+		for (int j = 0; j < batch; j++)
+			iters += bench_dequeue_one();
+		elapsed += now_ns() - start;
+	}
+
+	while (bench_dequeue_one())
+		;
+	buffer = &b_temp;
+
+	sprintf(params, "algo=%s;depth=%d;dups=%d", algo_names[algo], depth, dups);
+	report("queue_dequeue", params, iters, elapsed);
+}
+
+// Shared by the producer and the consumers of bench_queue_threads()
+long thread_iters;
+long thread_consumed;
+
+// Same locking and dequeue as thread_request_serve_static(), without serving anything
+void* bench_consumer(void *arg) {
+	Flight *f;
+	int leader;
+	Request *r;
+
+	while (1) {
+		pthread_mutex_lock(&mutex);
+		while ((r = request_dequeue(&f, &leader)) == NULL && thread_consumed < thread_iters)
+			pthread_cond_wait(&fullBuff, &mutex);
+		if (r == NULL) {
+			pthread_mutex_unlock(&mutex);
+			return NULL;
+		}
+		if (++thread_consumed == thread_iters)
+			pthread_cond_broadcast(&fullBuff);	// let the other consumers exit
+		pthread_cond_signal(&emptyBuff);
+		pthread_mutex_unlock(&mutex);
+
+		bench_finish(r, f);
+	}
+}
+
+//
+// One producer (as in request_handle()) handing requests to 'threads' consumers
+//
+void bench_queue_threads(int algo, int threads, int depth, int dups) {
+	Buffer b = {NULL, NULL, 0};
+	pthread_t pool[threads];
+	unsigned int seed = 1;
+	char filename[MAXBUF], params[MAXBUF];
+
+	buffer = &b;
+	scheduling_algo = algo;
+	thread_iters = THREAD_ITERS * scale;
+	thread_consumed = 0;
+	buffer_max_size = depth;
+
+	long start = now_ns();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&pool[i], NULL, bench_consumer, NULL);
+	for (long i = 0; i < thread_iters; i++) {
+		int filesize = next_request(dups, &seed, i, filename);
+		pthread_mutex_lock(&mutex);
+		while (b.count == buffer_max_size)
+			pthread_cond_wait(&emptyBuff, &mutex);
+		bench_enqueue(algo, filename, filesize, i);
+		pthread_cond_signal(&fullBuff);
+		pthread_mutex_unlock(&mutex);
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join(pool[i], NULL);
+	long elapsed = now_ns() - start;
+	buffer = &b_temp;
+
+	sprintf(params, "algo=%s;threads=%d;depth=%d;dups=%d", algo_names[algo], threads, depth, dups);
+	report("queue_threads", params, thread_iters, elapsed);
+}
+// ----------------------------------------------------------------
+
+// Parsing and formatting
+// ----------------------------------------------------------------
+void bench_parse_uri(char *name, char *uri) {
+	char buf[MAXBUF], filename[MAXBUF], cgiargs[MAXBUF], params[MAXBUF];
+	long iters = PARSE_ITERS * scale;
+
+	// request_parse_uri() cuts dynamic URIs at '?', so it gets a fresh copy each time
+	long start = now_ns();
+	for (long i = 0; i < iters; i++) {
+		strcpy(buf, uri);
+		request_parse_uri(buf, filename, cgiargs);
+	}
+	long elapsed = now_ns() - start;
+
+	sprintf(params, "uri=%s", name);
+	report("parse_uri", params, iters, elapsed);
+}
+
+void bench_filetype(char *filename) {
+	char filetype[MAXBUF], params[MAXBUF];
+	long iters = PARSE_ITERS * scale;
+
+	long start = now_ns();
+	for (long i = 0; i < iters; i++)
+		request_get_filetype(filename, filetype);
+	long elapsed = now_ns() - start;
+
+	sprintf(params, "file=%s", filename);
+	report("filetype", params, iters, elapsed);
+}
+
+void bench_format_header(int filesize, char *filetype) {
+	char buf[MAXBUF], params[MAXBUF];
+	long iters = PARSE_ITERS * scale;
+
+	long start = now_ns();
+	for (long i = 0; i < iters; i++)
+		request_format_header(buf, filesize, filetype);
+	long elapsed = now_ns() - start;
+
+	sprintf(params, "size=%d;type=%s", filesize, filetype);
+	report("format_header", params, iters, elapsed);
+}
+// ----------------------------------------------------------------
+
+// Reading request headers
+// ----------------------------------------------------------------
+//
+// Throwaway self-signed certificate for tls_init(), which reads it from files
+//
+void bench_tls_init() {
+	char cert_file[] = "/tmp/wbench-cert-XXXXXX", key_file[] = "/tmp/wbench-key-XXXXXX";
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	EVP_PKEY *pkey = NULL;
+	X509 *x509 = X509_new();
+	FILE *fp;
+
+	// P-256 key, with calls that OpenSSL 1.1.1 has too
+	assert(pctx != NULL && x509 != NULL);
+	assert(EVP_PKEY_keygen_init(pctx) > 0);
+	assert(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) > 0);
+	assert(EVP_PKEY_keygen(pctx, &pkey) > 0);
+	EVP_PKEY_CTX_free(pctx);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+	X509_set_pubkey(x509, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+		(unsigned char *) "localhost", -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(x509));
+	assert(X509_sign(x509, pkey, EVP_sha256()) > 0);
+
+	assert((fp = fdopen(mkstemp(cert_file), "w")) != NULL);
+	PEM_write_X509(fp, x509);
+	fclose(fp);
+	assert((fp = fdopen(mkstemp(key_file), "w")) != NULL);
+	PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+	fclose(fp);
+
+	tls_init_or_die(cert_file, key_file);
+	unlink(cert_file);
+	unlink(key_file);
+	X509_free(x509);
+	EVP_PKEY_free(pkey);
+}
+
+// from tls.c, not part of tls.h since they take OpenSSL types
+SSL* tls_conn(int fd);
+int tls_ktls_recv(SSL *ssl);
+
+void* bench_tls_connect(void *arg) {
+	assert(SSL_connect((SSL *) arg) == 1);
+	return NULL;
+}
+
+//
+// Connects over TCP loopback, as a client would (sv[0] - client, sv[1] - server)
+// With 'tls', the server side goes through tls_accept() (so kTLS is used when
+// the kernel has it) and the client's session is returned
+//
+SSL* bench_connect(int sv[2], int tls) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t client;
+	SSL *ssl = NULL;
+
+	int listen_fd = open_listen_fd_or_die(0);
+	assert(getsockname(listen_fd, (sockaddr_t *) &addr, &addrlen) == 0);
+	sv[0] = open_client_fd_or_die("localhost", ntohs(addr.sin_port));
+	sv[1] = accept_or_die(listen_fd, NULL, NULL);
+	close_or_die(listen_fd);
+
+	if (tls) {
+		// the client handshakes on its own thread while the server accepts
+		SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+		ssl = SSL_new(ctx);
+		SSL_CTX_free(ctx);
+		SSL_set_fd(ssl, sv[0]);
+		pthread_create(&client, NULL, bench_tls_connect, ssl);
+
+		// tls_accept() logs the handshake to stdout, keep it out of the table
+		fflush(stdout);
+		int saved = dup(STDOUT_FILENO);
+		int devnull = open_or_die("/dev/null", O_WRONLY, 0);
+		dup2_or_die(devnull, STDOUT_FILENO);
+		close_or_die(devnull);
+		assert(tls_accept(sv[1]) == 0);
+		fflush(stdout);
+		dup2_or_die(saved, STDOUT_FILENO);
+		close_or_die(saved);
+
+		pthread_join(client, NULL);
+	}
+	return ssl;
+}
+
+//
+// Reads a whole request of 'lines' header lines of 'linelen' bytes each
+// the way request_handle() does (one op = one request): with readline() on
+// a plain connection, or with tls_readline() on a TLS session
+//
+void bench_readline(int tls, int lines, int linelen) {
+	char request[MAXBUF * 4], buf[MAXBUF], params[MAXBUF];
+	int sv[2];
+
+	// Build the request: request line, headers padded to 'linelen', blank line
+	int len = sprintf(request, "GET /test1.html HTTP/1.1\r\n");
+	for (int i = 0; i < lines; i++) {
+		int n = sprintf(request + len, "X-Header-%d: ", i);
+		memset(request + len + n, 'a', linelen - n - 2);
+		memcpy(request + len + linelen - 2, "\r\n", 2);
+		len += linelen;
+	}
+	len += sprintf(request + len, "\r\n");
+	long iters = READLINE_BYTES * scale / len;
+
+	SSL *ssl = bench_connect(sv, tls);
+	ssize_t (*readfn)(int, void *, size_t) = tls ? tls_readline : readline;
+
+	// The client's write (and its encryption) is timed too
+	long start = now_ns();
+	for (long i = 0; i < iters; i++) {
+		if (tls)
+			assert(SSL_write(ssl, request, len) == len);
+		else
+			write_or_die(sv[0], request, len);
+		readfn(sv[1], buf, MAXBUF);
+		do {
+			assert(readfn(sv[1], buf, MAXBUF) > 0);
+		} while (strcmp(buf, "\r\n"));
+	}
+	long elapsed = now_ns() - start;
+
+	// kTLS changes what tls_readline() costs, so it is part of the case
+	if (tls)
+		sprintf(params, "lines=%d;bytes=%d;ktls=%s", lines, len, tls_ktls_recv(tls_conn(sv[1])) ? "on" : "off");
+	else
+		sprintf(params, "lines=%d;bytes=%d", lines, len);
+
+	if (tls) {
+		SSL_free(ssl);
+		tls_close_or_die(sv[1]);
+	} else {
+		close_or_die(sv[1]);
+	}
+	close_or_die(sv[0]);
+
+	report(tls ? "tls_readline" : "readline", params, iters, elapsed);
+}
+// ----------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+	int c;
+	int depths[] = { 8, 64, 512 };
+	int threads[] = { 1, 2, 4, 8 };
+	int dups[] = { 0, 25, 75 };
+
+	while ((c = getopt(argc, argv, "o:n:")) != -1)
+		switch (c) {
+			case 'o':
+				if ((csv = fopen(optarg, "w")) == NULL) {
+					fprintf(stderr, "wbench: cannot open %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'n':
+				scale = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: wbench [-o csvfile] [-n scale]\n");
+				exit(1);
+		}
+
+	drr_quantum = DEFAULT_QUANTUM;
+	client_max_active = DEFAULT_CLIENT_MAX_ACTIVE;
+	if (csv)
+		fprintf(csv, "benchmark,params,iterations,ns_per_op\n");
+
+	for (int algo = ALGO_FIFO; algo <= ALGO_DRR; algo++)
+		for (int d = 0; d < 3; d++)
+			for (int dist = SIZES_CONST; dist <= SIZES_PARETO; dist++)
+				bench_queue(algo, depths[d], dist);
+
+	for (int algo = ALGO_FIFO; algo <= ALGO_DRR; algo++)
+		for (int d = 0; d < 3; d++)
+			for (int u = 0; u < 3; u++)
+				bench_dequeue(algo, depths[d], dups[u]);
+
+	for (int algo = ALGO_FIFO; algo <= ALGO_DRR; algo++)
+		for (int t = 0; t < 4; t++)
+			bench_queue_threads(algo, threads[t], DEFAULT_BUFFER_SIZE, 25);
+
+	bench_parse_uri("static", "/test1.html");
+	bench_parse_uri("index", "/docs/");
+	bench_parse_uri("deep", "/a/very/long/path/to/some/deeply/nested/static/file/test1.html");
+	bench_parse_uri("dynamic", "/cgi-bin/spin.cgi?seconds=1&name=value");
+
+	bench_filetype("./test1.html");
+	bench_filetype("./image.gif");
+	bench_filetype("./photo.jpg");
+	bench_filetype("./notes.txt");
+
+	bench_format_header(150, "text/html");
+	bench_format_header(100000000, "image/jpeg");
+
+	bench_readline(0, 2, 32);
+	bench_readline(0, 16, 64);
+	bench_readline(0, 64, 128);
+
+	bench_tls_init();
+	bench_readline(1, 2, 32);
+	bench_readline(1, 16, 64);
+	bench_readline(1, 64, 128);
+
+	if (csv)
+		fclose(csv);
+	return 0;
+}
@@ -1,7 +1,17 @@
 #include "io_helper.h"
 #include "request.h"
+#include "tls.h"
 
 #define MAXBUF (8192)
+#define DRR_ADMIT_WAIT 1	// seconds the accept thread waits for space without contention (DRR)
+
+int buffer_max_size;
+int buffer_size;
+int scheduling_algo;
+int num_threads;
+int drr_quantum;
+int client_max_active;
+
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t fullBuff = PTHREAD_COND_INITIALIZER;
 pthread_cond_t emptyBuff = PTHREAD_COND_INITIALIZER;
@@ -15,24 +25,56 @@ pthread_cond_t emptyBuff = PTHREAD_COND_INITIALIZER;
 typedef struct Request_t {
 	char *filename;
 	int filesize;
+	dev_t dev;					// version of the file when it was requested
+	ino_t ino;
+	struct timespec mtime;
+	long seq;					// arrival order
 	int fd;
+	struct Client_t *client;	// owning client (DRR only)
 	struct Request_t *next;
 } Request;
 
-void makeRequest(Request *r, char *filename, int filesize, int fd) {
+long requests_queued = 0;		// requests inserted so far, numbers them by arrival
+
+void makeRequest(Request *r, char *filename, struct stat *sbuf, int fd) {
 	r->filename = strdup(filename);
-	r->filesize = filesize;
+	r->filesize = sbuf->st_size;
+	r->dev = sbuf->st_dev;
+	r->ino = sbuf->st_ino;
+	r->mtime = sbuf->st_mtim;
+	r->seq = requests_queued++;
 	r->fd = fd;
+	r->client = NULL;
 	r->next = NULL;
 }
 // ----------------------------------------------------------------
 
+// Client - per source address sub-queue of Requests (used by DRR)
+// ----------------------------------------------------------------
+typedef struct Client_t {
+	in_addr_t addr;
+	Request *front;
+	Request *rear;
+	int count;					// requests waiting in this sub-queue
+	int in_service;				// requests currently being served by threads
+	long deficit;				// bytes this client may still send in its turn
+	struct Client_t *next;		// next in the list of known clients
+	struct Client_t *next_active;	// next in the round robin of backlogged clients
+} Client;
+// ----------------------------------------------------------------
+
 // Buffer - used as a wrapper for Request
 // ----------------------------------------------------------------
 typedef struct Buffer_t {
 	Request *front;
 	Request *rear;
 	int count;
+	Client *clients;			// all clients with queued or in service requests (DRR)
+	Client *active_front;		// round robin of clients with queued requests (DRR)
+	Client *active_rear;
+	int num_active;
+	int turn_started;			// 'active_front' already got its quantum for this turn
+	int stalled;				// no slot freed up while the accept thread waited (DRR)
 } Buffer;
 
 // Check if Buffer is empty
@@ -54,10 +96,10 @@ int BufferIsFull(Buffer* buf) {
 
 // First In First Out (FIFO)
 // ----------------------------------------------------------------
-void insertFIFO(Buffer *buf, char *filename, int filesize, int fd) {
+void insertFIFO(Buffer *buf, char *filename, struct stat *sbuf, int fd) {
 	// Create and make request
 	Request *r = (Request*)malloc(sizeof(Request));
-	makeRequest(r, filename, filesize, fd);
+	makeRequest(r, filename, sbuf, fd);
 
 	if(BufferIsFull(buf)) {
 		printf("Buffer is full\n");
@@ -96,10 +138,10 @@ Request* deleteFIFO(Buffer *buf) {
 
 // Smallest File First (SFF)
 // ----------------------------------------------------------------
-void insertSFF(Buffer *buf, char *filename, int filesize, int fd) {
+void insertSFF(Buffer *buf, char *filename, struct stat *sbuf, int fd) {
 	// Create and make Request
 	Request *r = (Request*)malloc(sizeof(Request));
-	makeRequest(r, filename, filesize, fd);
+	makeRequest(r, filename, sbuf, fd);
 
 	if(BufferIsFull(buf)) {
 		printf("Buffer is full\n");
@@ -122,6 +164,8 @@ void insertSFF(Buffer *buf, char *filename, int filesize, int fd) {
 			}
 			r->next = ptr->next;
 			ptr->next = r;
+			if(r->next == NULL)	// Inserted at the end
+				buf->rear = r;
 		}
 	}
 	buf->count++;
@@ -147,8 +191,383 @@ Request* deleteSFF(Buffer *buf) {
 }
 // ----------------------------------------------------------------
 
+// Deficit Round Robin (DRR)
+// Requests are queued per client address, and clients are visited in
+// round robin order. Every turn a client is credited 'drr_quantum' bytes
+// and may only dequeue requests whose file fits in its accumulated credit,
+// so one client flooding the buffer cannot starve the others.
+// ----------------------------------------------------------------
+Client* findClient(Buffer *buf, in_addr_t addr) {
+	Client *c = buf->clients;
+	while(c != NULL && c->addr != addr)
+		c = c->next;
+	if(c == NULL) {
+		c = (Client*)calloc(1, sizeof(Client));
+		c->addr = addr;
+		c->next = buf->clients;
+		buf->clients = c;
+	}
+	return c;
+}
+
+// Forget a client once it has nothing queued or in service
+void releaseClient(Buffer *buf, Client *c) {
+	if(c->count > 0 || c->in_service > 0)
+		return;
+
+	Client **ptr = &buf->clients;
+	while(*ptr != c)
+		ptr = &(*ptr)->next;
+	*ptr = c->next;
+	free(c);
+}
+
+int ClientIsCapped(Client *c) {
+	return client_max_active > 0 && c->in_service >= client_max_active;
+}
+
+void activateClient(Buffer *buf, Client *c) {
+	c->next_active = NULL;
+	if(buf->active_rear == NULL)
+		buf->active_front = c;
+	else
+		buf->active_rear->next_active = c;
+	buf->active_rear = c;
+	buf->num_active++;
+}
+
+// Ends the turn of the client at the front of the round robin
+Client* deactivateClient(Buffer *buf) {
+	Client *c = buf->active_front;
+	buf->active_front = c->next_active;
+	if(buf->active_front == NULL)
+		buf->active_rear = NULL;
+	c->next_active = NULL;
+	buf->num_active--;
+	buf->turn_started = 0;
+	return c;
+}
+
+void insertDRR(Buffer *buf, char *filename, struct stat *sbuf, int fd, in_addr_t addr) {
+	if(BufferIsFull(buf)) {
+		printf("Buffer is full\n");
+		return;
+	}
+
+	// Create and make Request
+	Request *r = (Request*)malloc(sizeof(Request));
+	makeRequest(r, filename, sbuf, fd);
 
-// Global Buffer for FIFO and SFF
+	Client *c = findClient(buf, addr);
+	r->client = c;
+	if(c->count == 0) {
+		c->front = r;
+		activateClient(buf, c);
+	}
+	else {
+		c->rear->next = r;
+	}
+	c->rear = r;
+	c->count++;
+	buf->count++;
+}
+
+// Admission control: when the buffer is full and other clients are
+// backlogged too, the accept thread does not wait for free space, or a
+// client with a long backlog would hold back every request behind it.
+// The longest sub-queue gives up its newest request to make room instead,
+// unless the incoming client would then be the longest one itself.
+// Without contention it waits like FIFO and SFF, until the buffer is
+// 'stalled' (no slot freed up in DRR_ADMIT_WAIT seconds).
+// Returns 1 if the incoming request can be inserted, 0 if it has to be
+// turned away and -1 if the accept thread should wait for free space.
+// Sets '*dropped' to the request pushed out of the buffer, if any.
+int admitDRR(Buffer *buf, in_addr_t addr, Request **dropped) {
+	Client *c, *longest = NULL;
+	int own = 0, others = 0;
+
+	*dropped = NULL;
+	if(!BufferIsFull(buf))
+		return 1;
+
+	for(c = buf->active_front; c != NULL; c = c->next_active) {
+		if(longest == NULL || c->count > longest->count)
+			longest = c;
+		if(c->addr == addr)
+			own = c->count;
+		else
+			others = 1;
+	}
+	if(!others && !buf->stalled)
+		return -1;		// only this client is queued, nobody to be fair to
+	if(longest == NULL || own + 1 >= longest->count) {
+		// Nobody hogs more of the buffer than this client would
+		if(own == 0 && !buf->stalled)
+			return -1;
+		return 0;
+	}
+
+	// Unlink the tail of the longest sub-queue (it keeps at least one request)
+	Request *prev = NULL, *temp = longest->front;
+	while(temp->next != NULL) {
+		prev = temp;
+		temp = temp->next;
+	}
+	prev->next = NULL;
+	longest->rear = prev;
+	longest->count--;
+	buf->count--;
+	*dropped = temp;
+	return 1;
+}
+
+// Returns NULL if every backlogged client is at its concurrency cap
+Request* deleteDRR(Buffer *buf) {
+	int visited = 0, eligible = 0;
+	long rounds = 0;	// fewest whole rounds any eligible client still needs
+
+	while(buf->active_front != NULL) {
+		Client *c = buf->active_front;
+
+		if(!ClientIsCapped(c)) {
+			if(!buf->turn_started) {
+				c->deficit += drr_quantum;
+				buf->turn_started = 1;
+			}
+
+			// Head request fits in the credit, serve it
+			if(c->front->filesize <= c->deficit) {
+				Request *temp = c->front;
+				c->front = temp->next;
+				temp->next = NULL;
+				c->deficit -= temp->filesize;
+				c->count--;
+				c->in_service++;
+				buf->count--;
+				if(c->count == 0) {	// Idle clients do not keep their credit
+					c->rear = NULL;
+					c->deficit = 0;
+					deactivateClient(buf);
+				}
+				return temp;
+			}
+
+			long need = (c->front->filesize - c->deficit + drr_quantum - 1) / drr_quantum;
+			if(eligible == 0 || need < rounds)
+				rounds = need;
+			eligible++;
+		}
+
+		// Turn over, move the client to the back of the round robin
+		activateClient(buf, deactivateClient(buf));
+
+		if(++visited == buf->num_active) {
+			if(eligible == 0)
+				return NULL;
+
+			// Nobody could send during a full pass: skip the empty rounds
+			// at once instead of spinning through them one quantum at a time
+			for(c = buf->active_front; c != NULL; c = c->next_active)
+				if(!ClientIsCapped(c))
+					c->deficit += (rounds - 1) * drr_quantum;
+			visited = 0;
+			eligible = 0;
+		}
+	}
+	return NULL;
+}
+
+// Called once a thread has finished serving a DRR request
+void finishDRR(Buffer *buf, Request *r) {
+	r->client->in_service--;
+	releaseClient(buf, r->client);
+}
+// ----------------------------------------------------------------
+
+// Request coalescing
+// Requests for the same version of a file share a single open/mmap of it and a single
+// formatted header, kept in a Flight. The thread that dequeues the first
+// request for a file becomes its leader and maps the file, moving the
+// queued duplicates onto the Flight so idle threads pick them up next.
+// Every thread still sends its own copy, so one slow reader only holds
+// its own thread. The last thread done with a Flight unmaps the file.
+// ----------------------------------------------------------------
+typedef struct Flight_t {
+	char *filename;
+	int filesize;
+	dev_t dev;					// version of the file, as in the Requests
+	ino_t ino;
+	struct timespec mtime;
+	int srcfd;
+	char *srcp;					// mapping of the file, shared by the senders
+	char header[MAXBUF];
+	int headerlen;
+	int ready;					// 'srcfd', 'srcp' and 'header' are filled in
+	long ready_seq;				// 'requests_queued' when it became ready
+	int refs;					// threads currently sending this file
+	Request *pending;			// duplicates taken from the buffer, not yet sent
+	struct Flight_t *next;
+} Flight;
+
+Flight *flights = NULL;		// files currently being sent by a thread
+pthread_cond_t flightReady = PTHREAD_COND_INITIALIZER;
+
+// A Request joins a Flight only for the same version of the file (a file
+// replaced meanwhile has a new inode or mtime), and only if it was queued
+// before that Flight got ready, so a hot file cannot keep one Flight, and
+// the mapping of an old version, alive for as long as requests keep coming
+int FlightMatches(Flight *f, Request *r) {
+	return f->filesize == r->filesize && f->dev == r->dev && f->ino == r->ino &&
+		f->mtime.tv_sec == r->mtime.tv_sec && f->mtime.tv_nsec == r->mtime.tv_nsec &&
+		(!f->ready || r->seq < f->ready_seq) && strcmp(f->filename, r->filename) == 0;
+}
+
+// Unlinks the Requests matching 'f' from a queue, appending them to 'list'
+// Returns the number of Requests removed
+int takeFromQueue(Request **front, Request **rear, Flight *f, Request ***list) {
+	int taken = 0;
+	Request *prev = NULL, **ptr = front;
+	while(*ptr != NULL) {
+		Request *cur = *ptr;
+		if(FlightMatches(f, cur)) {
+			*ptr = cur->next;
+			cur->next = NULL;
+			**list = cur;
+			*list = &cur->next;
+			taken++;
+		}
+		else {
+			prev = cur;
+			ptr = &cur->next;
+		}
+	}
+	*rear = prev;
+	return taken;
+}
+
+// Same as takeFromQueue() for a DRR sub-queue, but a duplicate is only
+// taken while its client is under the concurrency cap and can pay for it
+// from its deficit, exactly as if deleteDRR() had picked it
+int takeFromClient(Client *c, Flight *f, Request ***list) {
+	int taken = 0;
+	Request *prev = NULL, **ptr = &c->front;
+	while(*ptr != NULL && !ClientIsCapped(c) && c->deficit >= f->filesize) {
+		Request *cur = *ptr;
+		if(FlightMatches(f, cur)) {
+			*ptr = cur->next;
+			cur->next = NULL;
+			**list = cur;
+			*list = &cur->next;
+			c->deficit -= cur->filesize;
+			c->count--;
+			c->in_service++;
+			taken++;
+		}
+		else {
+			prev = cur;
+			ptr = &cur->next;
+		}
+	}
+	if(*ptr == NULL)
+		c->rear = prev;
+	return taken;
+}
+
+// Removes a client from anywhere in the round robin of backlogged clients
+void removeActive(Buffer *buf, Client *c) {
+	if(buf->active_front == c) {
+		deactivateClient(buf);
+		return;
+	}
+	Client *prev = buf->active_front;
+	while(prev->next_active != c)
+		prev = prev->next_active;
+	prev->next_active = c->next_active;
+	if(buf->active_rear == c)
+		buf->active_rear = prev;
+	c->next_active = NULL;
+	buf->num_active--;
+}
+
+// Moves every queued Request matching 'f' from the buffer to its pending list
+// Returns the number of Requests moved
+int takeDuplicates(Buffer *buf, Flight *f) {
+	int before = buf->count;
+	Request **list = &f->pending;
+	while(*list != NULL)
+		list = &(*list)->next;
+
+	if(scheduling_algo == 2) {	// DRR: duplicates may sit in any client's sub-queue, each owner pays its own
+		Client *c = buf->active_front;
+		while(c != NULL) {
+			Client *next = c->next_active;
+			int taken = takeFromClient(c, f, &list);
+			buf->count -= taken;
+			if(taken && c->count == 0) {
+				c->deficit = 0;
+				removeActive(buf, c);
+			}
+			c = next;
+		}
+	}
+	else {						// FIFO and SFF
+		buf->count -= takeFromQueue(&buf->front, &buf->rear, f, &list);
+	}
+	return before - buf->count;
+}
+
+Flight* findFlight(Request *r) {
+	Flight *f = flights;
+	while(f != NULL && !FlightMatches(f, r))
+		f = f->next;
+	return f;
+}
+
+Flight* startFlight(Request *r) {
+	Flight *f = (Flight*)calloc(1, sizeof(Flight));
+	f->filename = strdup(r->filename);
+	f->filesize = r->filesize;
+	f->dev = r->dev;
+	f->ino = r->ino;
+	f->mtime = r->mtime;
+	f->refs = 1;
+	f->next = flights;
+	flights = f;
+	return f;
+}
+
+// Next pending duplicate of any Flight, the caller joins that Flight
+Request* takePending(Flight **fp) {
+	Flight *f;
+	for(f = flights; f != NULL; f = f->next) {
+		if(f->pending != NULL) {
+			Request *r = f->pending;
+			f->pending = r->next;
+			r->next = NULL;
+			f->refs++;
+			*fp = f;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+// Drops a reference to 'f', returns 1 if it was the last one
+// (the Flight is then unlinked and the caller has to unmap and free it)
+int releaseFlight(Flight *f) {
+	if(--f->refs > 0 || f->pending != NULL)
+		return 0;
+
+	Flight **ptr = &flights;
+	while(*ptr != f)
+		ptr = &(*ptr)->next;
+	*ptr = f->next;
+	return 1;
+}
+// ----------------------------------------------------------------
+
+
+// Global Buffer for FIFO, SFF and DRR
 // ----------------------------------------------------------------
 Buffer b_temp = {NULL,  NULL, 0};
 Buffer *buffer = &b_temp;
@@ -173,33 +592,35 @@ void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *long
 		"</html>\r\n", errnum, shortmsg, longmsg, cause);
 	
 	// Write out the header information for this response
+	// (the client may be gone already, the connection is closed either way)
 	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	write_or_die(fd, buf, strlen(buf));
+	tls_write(fd, buf, strlen(buf));
 	
 	sprintf(buf, "Content-Type: text/html\r\n");
-	write_or_die(fd, buf, strlen(buf));
+	tls_write(fd, buf, strlen(buf));
 	
 	sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-	write_or_die(fd, buf, strlen(buf));
+	tls_write(fd, buf, strlen(buf));
 	
 	// Write out the body last
-	write_or_die(fd, body, strlen(body));
+	tls_write(fd, body, strlen(body));
 	
 	// close the socket connection
-	close_or_die(fd);
+	tls_close_or_die(fd);
 }
 
 //
 // Reads and discards everything up to an empty text line
+// Returns -1 if the connection ends or breaks before that
 //
-void request_read_headers(int fd) {
+int request_read_headers(int fd) {
 	char buf[MAXBUF];
 	
-	readline_or_die(fd, buf, MAXBUF);
-	while (strcmp(buf, "\r\n")) {
-		readline_or_die(fd, buf, MAXBUF);
-	}
-	return;
+	do {
+		if (tls_readline(fd, buf, MAXBUF) <= 0)
+			return -1;
+	} while (strcmp(buf, "\r\n"));
+	return 0;
 }
 
 //
@@ -246,33 +667,122 @@ void request_get_filetype(char *filename, char *filetype) {
 }
 
 //
-// Handles requests for static content
+// Puts together the response header for static content, returns its length
 //
-void request_serve_static(int fd, char *filename, int filesize) {
-	int srcfd;
-	char *srcp, filetype[MAXBUF], buf[MAXBUF];
-	
-	request_get_filetype(filename, filetype);
-	srcfd = open_or_die(filename, O_RDONLY, 0);
-	
-	// Rather than call read() to read the file into memory, 
-	// which would require that we allocate a buffer, we memory-map the file
-	srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-	close_or_die(srcfd);
-	
-	// put together response
-	sprintf(buf, ""
+int request_format_header(char *buf, int filesize, char *filetype) {
+	return sprintf(buf, ""
 		"HTTP/1.0 200 OK\r\n"
 		"Server: OSTEP WebServer\r\n"
 		"Content-Length: %d\r\n"
 		"Content-Type: %s\r\n\r\n", 
 		filesize, filetype);
-	   
-	write_or_die(fd, buf, strlen(buf));
+}
+
+//
+// Takes the next request to serve from the buffer, 'mutex' must be held
+// Sets '*fp' to the Flight of the request, and '*leader' if the caller
+// started that Flight and has to map the file for it
+// Returns NULL if nothing can be served right now
+//
+Request* request_dequeue(Flight **fp, int *leader) {
+	Request *r;
+	*leader = 0;
+
+	// Duplicates already moved onto a Flight come first
+	if((r = takePending(fp)) != NULL)
+		return r;
+
+	if(buffer->count == 0)
+		return NULL;
+
+	// Remove the request from the buffer to serve it
+	if(scheduling_algo == 2)	// DRR Scheduling (NULL if every client is capped)
+		r = deleteDRR(buffer);
+	else if(scheduling_algo)	// SFF Scheduling
+		r = deleteSFF(buffer);
+	else						// FIFO Scheduling
+		r = deleteFIFO(buffer);
+	if(r == NULL)
+		return NULL;
+	r->next = NULL;		// FIFO and SFF leave it pointing into the buffer
+	buffer->stalled = 0;
+
+	// Share the mapping of a thread already sending this file, if any
+	Flight *f = findFlight(r);
+	if(f)
+		f->refs++;
+	else {
+		f = startFlight(r);
+		*leader = 1;
+	}
+
+	// Group the queued duplicates onto the Flight, for the idle threads
+	if(takeDuplicates(buffer, f))
+		pthread_cond_broadcast(&fullBuff);
+
+	*fp = f;
+	return r;
+}
+
+//
+// Handles requests for static content
+// The leader of the Flight opens and maps the file, the other threads
+// sending it wait for that and reuse the mapping and the header
+//
+void request_serve_static(Flight *f, int leader, Request *r) {
+	char filetype[MAXBUF];
 	
-	//  Writes out to the client socket the memory-mapped file 
-	write_or_die(fd, srcp, filesize);
-	munmap_or_die(srcp, filesize);
+	if(leader) {
+		request_get_filetype(f->filename, filetype);
+		f->srcfd = open_or_die(f->filename, O_RDONLY, 0);
+		
+		// Rather than call read() to read the file into memory, 
+		// which would require that we allocate a buffer, we memory-map the file
+		// ('srcfd' stays open for sendfile(), the mapping serves userspace TLS)
+		f->srcp = mmap_or_die(0, f->filesize, PROT_READ, MAP_PRIVATE, f->srcfd, 0);
+		
+		// put together response
+		f->headerlen = request_format_header(f->header, f->filesize, filetype);
+		
+		pthread_mutex_lock(&mutex);
+		f->ready = 1;
+		f->ready_seq = requests_queued;
+		pthread_cond_broadcast(&flightReady);
+		pthread_mutex_unlock(&mutex);
+	}
+	else {
+		pthread_mutex_lock(&mutex);
+		while(!f->ready)
+			pthread_cond_wait(&flightReady, &mutex);
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	//  Writes out the header and the file to the client socket (sendfile() when possible)
+	//  A client closing or resetting the connection meanwhile only ends its own request
+	if (tls_write(r->fd, f->header, f->headerlen) < 0 ||
+		tls_sendfile(r->fd, f->srcfd, f->srcp, f->filesize) < 0)
+		printf("Request for %s is cut short, the client closed the connection.\n", r->filename);
+	// Close the file descriptor
+	tls_close_or_die(r->fd);
+	
+	pthread_mutex_lock(&mutex);
+	if(r->client) {
+		// Client may have dropped under its cap, wake up a thread
+		finishDRR(buffer, r);
+		pthread_cond_signal(&fullBuff);
+	}
+	int last = releaseFlight(f);
+	pthread_mutex_unlock(&mutex);
+	
+	// Last thread out unmaps the file
+	if(last) {
+		munmap_or_die(f->srcp, f->filesize);
+		close_or_die(f->srcfd);
+		free(f->filename);
+		free(f);
+	}
+	free(r->filename);
+	free(r);
 }
 
 //
@@ -283,36 +793,28 @@ void* thread_request_serve_static(void* arg)
 	// TODO: write code to actualy respond to HTTP requests
 	// ----------------------------------------------------------------
 	while(1) { // Loop until the buffer is empty
+		Flight *f;
+		int leader;
+		Request *r;
 
 		// Mutex lock for the critical section
 		pthread_mutex_lock(&mutex);
-		// Wait for the buffer to have something in it
-		while(buffer && buffer->count == 0)
+		// Wait for the buffer to have something to serve in it
+		while((r = request_dequeue(&f, &leader)) == NULL)
 			pthread_cond_wait(&fullBuff, &mutex);
 
-		// Create request to store the removed request from the buffer 
-		Request *r = NULL;
-
-		// Remove the request from the buffer to serve it
-		if(scheduling_algo) // SFF Scheduling
-			r = deleteSFF(buffer);
-		else                // FIFO Scheduling
-			r = deleteFIFO(buffer);
-
-		if(r)
+		if(leader)
 			printf("Request for %s is removed from the buffer.\n", r->filename);
+		else
+			printf("Request for %s shares the file mapped for another thread.\n", r->filename);
 
 		// Release signal on the condition variable 'empty'
 		pthread_cond_signal(&emptyBuff);
 		// Mutex unlock for the critical section
 		pthread_mutex_unlock(&mutex);
 
-		if(r) {
-			// Serve request
-			request_serve_static(r->fd, r->filename, r->filesize);
-			// Close the file descriptor
-			close_or_die(r->fd);
-		}
+		// Serve request
+		request_serve_static(f, leader, r);
 	}
 	// ----------------------------------------------------------------
 }
@@ -320,14 +822,18 @@ void* thread_request_serve_static(void* arg)
 //
 // Initial handling of the request
 //
-void request_handle(int fd) {
+void request_handle(int fd, in_addr_t client_addr) {
 	int is_static;
 	struct stat sbuf;
 	char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
 	char filename[MAXBUF], cgiargs[MAXBUF];
 	
 	// get the request type, file path and HTTP version
-	readline_or_die(fd, buf, MAXBUF);
+	// (a client closing or breaking the connection early is just dropped)
+	if (tls_readline(fd, buf, MAXBUF) <= 0) {
+		tls_close_or_die(fd);
+		return;
+	}
 	sscanf(buf, "%s %s %s", method, uri, version);
 	printf("method:%s uri:%s version:%s\n", method, uri, version);
 
@@ -336,7 +842,10 @@ void request_handle(int fd) {
 		request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
 		return;
 	}
-	request_read_headers(fd);
+	if (request_read_headers(fd) < 0) {
+		tls_close_or_die(fd);
+		return;
+	}
 	
 	// check requested content type (static/dynamic)
 	is_static = request_parse_uri(uri, filename, cgiargs);
@@ -364,20 +873,34 @@ void request_handle(int fd) {
 		
 		// TODO: write code to add HTTP requests in the buffer based on the scheduling policy
 		// ----------------------------------------------------------------
+		int admitted = 1;
+		Request *dropped = NULL;
+
 		// Mutex lock for the critical section
 		pthread_mutex_lock(&mutex);
-		// Wait for the buffer to have free space available
-		while(buffer && buffer->count == buffer_max_size)
+		// Wait for the buffer to have free space available (DRR makes room instead)
+		while(buffer && scheduling_algo != 2 && buffer->count == buffer_max_size)
 			pthread_cond_wait(&emptyBuff, &mutex);
 		if(buffer) {
 			// Insert the request into the buffer
-			if(scheduling_algo)	// SFF Scheduling
-				insertSFF(buffer, filename, sbuf.st_size, fd);
+			if(scheduling_algo == 2) {	// DRR Scheduling
+				struct timespec deadline;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += DRR_ADMIT_WAIT;
+				while((admitted = admitDRR(buffer, client_addr, &dropped)) < 0)
+					if(pthread_cond_timedwait(&emptyBuff, &mutex, &deadline) == ETIMEDOUT)
+						buffer->stalled = 1;
+				if(admitted)
+					insertDRR(buffer, filename, &sbuf, fd, client_addr);
+			}
+			else if(scheduling_algo)	// SFF Scheduling
+				insertSFF(buffer, filename, &sbuf, fd);
 			else				// FIFO Scheduling
-				insertFIFO(buffer, filename, sbuf.st_size, fd);
+				insertFIFO(buffer, filename, &sbuf, fd);
 		}
 		
-		printf("Request for %s is added to the buffer.\n", filename);
+		if(admitted)
+			printf("Request for %s is added to the buffer.\n", filename);
 
 		// if(buffer) {
 		// 	if(scheduling_algo)	// SFF Scheduling
@@ -390,6 +913,15 @@ void request_handle(int fd) {
 		pthread_cond_signal(&fullBuff);
 		// Mutex unlock for the critical section
 		pthread_mutex_unlock(&mutex);
+
+		// Turn away what did not fit into the buffer
+		if(!admitted)
+			request_error(fd, filename, "503", "Service Unavailable", "server is too busy to queue this request");
+		if(dropped) {
+			request_error(dropped->fd, dropped->filename, "503", "Service Unavailable", "server is busy with other requests of this client");
+			free(dropped->filename);
+			free(dropped);
+		}
 		// ----------------------------------------------------------------
 	} else {
 		request_error(fd, filename, "501", "Not Implemented", "server does not serve dynamic content request");
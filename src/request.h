@@ -1,15 +1,22 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include <netinet/in.h>
 
 #define DEFAULT_BUFFER_SIZE 64
 #define DEFAULT_THREADS 4
-#define DEFAULT_SCHED_ALGO 0		// 0 - FIFO, 1 - SFF
+#define DEFAULT_SCHED_ALGO 0		// 0 - FIFO, 1 - SFF, 2 - DRR
+#define DEFAULT_QUANTUM 8192		// bytes credited to a client per DRR round
+#define DEFAULT_CLIENT_MAX_ACTIVE 0	// max requests of one client in service at once (0 - no limit)
 
-int buffer_max_size;
-int buffer_size;
-int scheduling_algo;
-int num_threads;
+extern int buffer_max_size;
+extern int buffer_size;
+extern int scheduling_algo;
+extern int num_threads;
+extern int drr_quantum;
+extern int client_max_active;
 
-void request_handle(int fd);
+void request_handle(int fd, in_addr_t client_addr);
 void* thread_request_serve_static(void* arg);
 
 #endif // __REQUEST_H__
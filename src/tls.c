@@ -0,0 +1,190 @@
+#include "io_helper.h"
+#include "tls.h"
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// kTLS and SSL_sendfile() came with OpenSSL 3.0, older versions always
+// encrypt in userspace (file bodies then go through the mapping with SSL_write())
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define TLS_HAVE_KTLS
+#endif
+
+SSL_CTX *tls_ctx = NULL;
+SSL **tls_conns = NULL;		// TLS session of each socket descriptor (NULL - plaintext)
+long tls_max_fd = 0;
+
+SSL* tls_conn(int fd) {
+	if (tls_conns == NULL || fd < 0 || fd >= tls_max_fd)
+		return NULL;
+	return tls_conns[fd];
+}
+
+int tls_ktls_send(SSL *ssl) {
+#ifdef TLS_HAVE_KTLS
+	return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+	return 0;
+#endif
+}
+
+int tls_ktls_recv(SSL *ssl) {
+#ifdef TLS_HAVE_KTLS
+	return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+	return 0;
+#endif
+}
+
+//
+// Loads the certificate chain and private key, HTTPS is off until this is called
+//
+int tls_init(char *cert_file, char *key_file) {
+	if ((tls_ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	// Ask OpenSSL to install the session keys into the kernel after the handshake
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	// Clients closing the socket without close_notify just end the request
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) <= 0 ||
+		SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+		!SSL_CTX_check_private_key(tls_ctx)) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	tls_max_fd = sysconf(_SC_OPEN_MAX);
+	tls_conns = (SSL**)calloc(tls_max_fd, sizeof(SSL*));
+	return 0;
+}
+
+//
+// Performs the TLS handshake on a freshly accepted connection
+// Returns -1 on failure (the caller still owns and closes 'fd')
+//
+int tls_accept(int fd) {
+	SSL *ssl = SSL_new(tls_ctx);
+	if (ssl == NULL || fd >= tls_max_fd || !SSL_set_fd(ssl, fd) || SSL_accept(ssl) <= 0) {
+		fprintf(stderr, "TLS handshake failed\n");
+		ERR_print_errors_fp(stderr);
+		SSL_free(ssl);
+		return -1;
+	}
+	tls_conns[fd] = ssl;
+	printf("TLS handshake done: %s %s (kTLS send: %s, recv: %s)\n",
+		SSL_get_version(ssl), SSL_get_cipher(ssl),
+		tls_ktls_send(ssl) ? "on" : "off", tls_ktls_recv(ssl) ? "on" : "off");
+	return 0;
+}
+
+//
+// A failed read or write (reset, bad record, truncated stream) only ends
+// that connection: the session must not send close_notify anymore, so
+// tls_close() just frees it
+//
+void tls_fail(SSL *ssl) {
+	ERR_clear_error();
+	SSL_set_quiet_shutdown(ssl, 1);
+}
+
+ssize_t tls_read(int fd, void *buf, size_t count) {
+	SSL *ssl = tls_conn(fd);
+	if (ssl == NULL)
+		return read(fd, buf, count);
+
+	int rc = SSL_read(ssl, buf, count);
+	if (rc > 0)
+		return rc;
+	if (SSL_get_error(ssl, rc) == SSL_ERROR_ZERO_RETURN)
+		return 0;	// peer sent close_notify (or just closed the socket)
+	tls_fail(ssl);
+	return -1;
+}
+
+ssize_t tls_write(int fd, const void *buf, size_t count) {
+	SSL *ssl = tls_conn(fd);
+	if (ssl == NULL)
+		return write(fd, buf, count);
+
+	// SSL_write() encrypts in userspace, or hands the data to kTLS when it is on
+	if (count == 0)
+		return 0;
+	if (SSL_write(ssl, buf, count) <= 0) {
+		tls_fail(ssl);
+		return -1;
+	}
+	return count;
+}
+
+//
+// Sends 'count' bytes of the file 'srcfd' (also mapped at 'srcp') to the client
+// sendfile() is used unless the connection has to be encrypted in userspace
+//
+ssize_t tls_sendfile(int fd, int srcfd, const char *srcp, size_t count) {
+	SSL *ssl = tls_conn(fd);
+	if (ssl != NULL && !tls_ktls_send(ssl))
+		return tls_write(fd, srcp, count);
+
+	off_t offset = 0;
+	while (offset < count) {
+		ssize_t rc;
+#ifdef TLS_HAVE_KTLS
+		if (ssl != NULL) {
+			rc = SSL_sendfile(ssl, srcfd, offset, count - offset, 0);
+			if (rc > 0)
+				offset += rc;
+		} else
+#endif
+			rc = sendfile(fd, srcfd, &offset, count - offset);
+		if (rc <= 0) {
+			if (ssl != NULL)
+				tls_fail(ssl);
+			return -1;	// error, or the file was truncated meanwhile
+		}
+	}
+	return offset;
+}
+
+//
+// Same as readline() in io_helper.c, over a TLS session when there is one
+//
+ssize_t tls_readline(int fd, void *buf, size_t maxlen) {
+	char c;
+	char *bufp = buf;
+	int n;
+	for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
+		int rc;
+		if ((rc = tls_read(fd, &c, 1)) == 1) {
+			*bufp++ = c;
+			if (c == '\n')
+				break;
+		} else if (rc == 0) {
+			if (n == 0)
+				return 0; /* EOF, no data read */
+			else
+				break;    /* EOF, some data was read */
+		} else
+			return -1;    /* error */
+	}
+	*bufp = '\0';
+	return n;
+}
+
+int tls_close(int fd) {
+	SSL *ssl = tls_conn(fd);
+	if (ssl != NULL) {
+		// Forget the session before 'fd' can be reused by accept()
+		tls_conns[fd] = NULL;
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+	return close(fd);
+}
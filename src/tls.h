@@ -0,0 +1,37 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <assert.h>
+#include <sys/types.h>
+
+//
+// Optional HTTPS support. The handshake is done with OpenSSL, after which
+// the session keys are handed to the kernel (kTLS) when it supports it, so
+// file bodies can still be sent with sendfile(). Connections without kTLS
+// fall back to encrypting in userspace. kTLS needs OpenSSL 3.0 or later
+// built with it and the kernel's tls module; with OpenSSL 1.1.1 every
+// connection is encrypted in userspace.
+//
+// Every function takes the plain socket descriptor; descriptors that did
+// not go through tls_accept() are served in plaintext.
+//
+// tls_read(), tls_write(), tls_sendfile() and tls_readline() return -1 when
+// the client breaks the connection (reset, bad record...). That only ends
+// the request: the caller closes 'fd' with tls_close() and carries on.
+//
+
+int tls_init(char *cert_file, char *key_file);
+int tls_accept(int fd);
+ssize_t tls_read(int fd, void *buf, size_t count);
+ssize_t tls_write(int fd, const void *buf, size_t count);
+ssize_t tls_sendfile(int fd, int srcfd, const char *srcp, size_t count);
+ssize_t tls_readline(int fd, void *buf, size_t maxlen);
+int tls_close(int fd);
+
+// wrappers for above (none for the client I/O, see above)
+#define tls_init_or_die(cert_file, key_file) \
+    assert(tls_init(cert_file, key_file) == 0);
+#define tls_close_or_die(fd) \
+    assert(tls_close(fd) == 0);
+
+#endif // __TLS_H__
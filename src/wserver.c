@@ -5,25 +5,29 @@
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "tls.h"
 #include <pthread.h>
 
 char default_root[] = ".";
 
 //
-// ./wserver [-d basedir] [-p port] [-t threads] [-b buffersize] [-s schedalg (0 - FIFO, 1 - SFF)]
+// ./wserver [-d basedir] [-p port] [-t threads] [-b buffersize] [-s schedalg (0 - FIFO, 1 - SFF, 2 - DRR)] [-q quantum] [-c clientmaxactive] [-C certfile -K keyfile]
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    char *cert_file = NULL, *key_file = NULL;
     
 	// below default values are defined in 'request.h'
     num_threads = DEFAULT_THREADS;
     buffer_max_size = DEFAULT_BUFFER_SIZE;
     scheduling_algo = DEFAULT_SCHED_ALGO;	
+    drr_quantum = DEFAULT_QUANTUM;
+    client_max_active = DEFAULT_CLIENT_MAX_ACTIVE;
     
 	// fetch (and set) values from command line arguments
-    while ((c = getopt(argc, argv, "d:p:t:b:s:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:q:c:C:K:")) != -1)
 		switch (c) {
 			case 'd':
 				root_dir = optarg;
@@ -40,11 +44,39 @@ int main(int argc, char *argv[]) {
 			case 's':
 				scheduling_algo = atoi(optarg);
 				break;
+			case 'q':
+				drr_quantum = atoi(optarg);
+				break;
+			case 'c':
+				client_max_active = atoi(optarg);
+				break;
+			case 'C':
+				cert_file = optarg;
+				break;
+			case 'K':
+				key_file = optarg;
+				break;
 			default:
-				fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffersize] [-s schedalg (0 - FIFO, 1 - SFF)]\n");
+				fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffersize] [-s schedalg (0 - FIFO, 1 - SFF, 2 - DRR)] [-q quantum] [-c clientmaxactive] [-C certfile -K keyfile]\n");
 				exit(1);
 		}
 
+	if (drr_quantum <= 0) {
+		fprintf(stderr, "wserver: quantum must be positive\n");
+		exit(1);
+	}
+	if ((cert_file == NULL) != (key_file == NULL)) {
+		fprintf(stderr, "wserver: HTTPS needs both -C certfile and -K keyfile\n");
+		exit(1);
+	}
+
+	// serve HTTPS if a certificate is given (paths are relative to the current directory)
+	if (cert_file)
+		tls_init_or_die(cert_file, key_file);
+
+	// writing to a client that reset the connection must fail, not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
     // browse to webserver's root directory
     chdir_or_die(root_dir);
 
@@ -64,8 +96,14 @@ int main(int argc, char *argv[]) {
 		int client_len = sizeof(client_addr);
 		int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
 		
-		// process the HTTP request
-		request_handle(conn_fd);
+		// TLS handshake, a client failing it is just dropped
+		if (cert_file && tls_accept(conn_fd) < 0) {
+			close_or_die(conn_fd);
+			continue;
+		}
+		
+		// process the HTTP request (client address is used by DRR for fair queueing)
+		request_handle(conn_fd, client_addr.sin_addr.s_addr);
 		
 		// close the connection to client
 		//close_or_die(conn_fd);	// this has to be carefully done at the correct time in request.c